@@ -0,0 +1,121 @@
+/*
+ * bench_passthrough.cpp - measure latency of passing through evdev events
+ *
+ * Copyright (C) 2009-2011 Adam Nielsen <a.nielsen@shikadi.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Feeds key events into a grabbed bindEvdev through a pipe, and times how
+// long each unused key takes to come out of its passthrough device (a socket
+// here, instead of uinput, so no special permissions are needed.)  Every so
+// often a hotkey is pressed as well, whose action sleeps to stand in for a
+// round trip to the XMMS2 daemon, to show that actions don't hold up the
+// passthrough.
+
+#define XMMS2HOTKEY_NO_MAIN
+#include "xmms2hotkey.cpp"
+#include "replay.h"
+
+#include <algorithm>
+#include <time.h>
+
+#define NUM_ITERATIONS 10000
+#define HOTKEY_EVERY   100   // press the hotkey every this many iterations
+#define ACTION_DELAY   2000  // microseconds each action takes
+
+#ifdef USE_EVDEV
+void slowAction()
+{
+	usleep(ACTION_DELAY);
+	return;
+}
+
+// Nanoseconds between two times
+long elapsed(const struct timespec& a, const struct timespec& b)
+{
+	return (b.tv_sec - a.tv_sec) * 1000000000L + (b.tv_nsec - a.tv_nsec);
+}
+
+int main(void)
+{
+	::config.bShowEvents = false;
+	loadHotkey(HK_EVDEV, KEY_F10, -1, 0, 0, &slowAction);
+	vcActiveHotkeys.reserve(vcHotkeys.size());
+
+	evdevReplay replay;
+	if (!replay.open()) return EXIT_FAILURE;
+	replay.start();
+
+	std::vector<long> vcLatency;
+	vcLatency.reserve(NUM_ITERATIONS);
+	for (int i = 0; i < NUM_ITERATIONS; i++) {
+		struct input_event ev[6];
+		int iNumEvents = 0;
+		int iValue = (i % 2) ? 0 : 1; // alternate press and release
+		if ((i % HOTKEY_EVERY) == 0) {
+			setEvent(&ev[iNumEvents++], EV_KEY, KEY_F10, 1);
+			setEvent(&ev[iNumEvents++], EV_SYN, SYN_REPORT, 0);
+			setEvent(&ev[iNumEvents++], EV_KEY, KEY_F10, 0);
+			setEvent(&ev[iNumEvents++], EV_SYN, SYN_REPORT, 0);
+		}
+		setEvent(&ev[iNumEvents++], EV_KEY, KEY_A, iValue);
+		setEvent(&ev[iNumEvents++], EV_SYN, SYN_REPORT, 0);
+
+		struct timespec tsStart, tsEnd;
+		clock_gettime(CLOCK_MONOTONIC, &tsStart);
+		if (!replay.send(ev, iNumEvents)) return EXIT_FAILURE;
+
+		// Wait for the KEY_A event to come out the other side
+		bool bSeen = false;
+		while (!bSeen) {
+			struct input_event out;
+			if (!replay.receive(&out)) return EXIT_FAILURE;
+			if ((out.type == EV_KEY) && (out.code == KEY_A)) {
+				if (out.value != iValue) {
+					std::cerr << "Wrong event passed through" << std::endl;
+					return EXIT_FAILURE;
+				}
+				bSeen = true;
+			} else if (out.type == EV_KEY) {
+				std::cerr << "Hotkey was passed through" << std::endl;
+				return EXIT_FAILURE;
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &tsEnd);
+		vcLatency.push_back(elapsed(tsStart, tsEnd));
+	}
+
+	replay.finish();
+
+	std::sort(vcLatency.begin(), vcLatency.end());
+	long iTotal = 0;
+	for (std::vector<long>::iterator i = vcLatency.begin(); i != vcLatency.end(); i++) iTotal += *i;
+	std::cout << "Passthrough latency over " << NUM_ITERATIONS << " events (us): "
+		<< "min " << vcLatency.front() / 1000.0
+		<< ", mean " << iTotal / vcLatency.size() / 1000.0
+		<< ", median " << vcLatency[vcLatency.size() / 2] / 1000.0
+		<< ", 99% " << vcLatency[vcLatency.size() * 99 / 100] / 1000.0
+		<< ", max " << vcLatency.back() / 1000.0 << std::endl;
+	std::cout << "(each action took " << ACTION_DELAY << "us)" << std::endl;
+	return EXIT_SUCCESS;
+}
+#else
+int main(void)
+{
+	std::cerr << "evdev support not compiled in, nothing to measure" << std::endl;
+	return 77;
+}
+#endif // USE_EVDEV
@@ -0,0 +1,107 @@
+/*
+ * replay.h - feed evdev events through bindEvdev for tests and benchmarks
+ *
+ * Copyright (C) 2009-2011 Adam Nielsen <a.nielsen@shikadi.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Must be included after xmms2hotkey.cpp (with XMMS2HOTKEY_NO_MAIN defined.)
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#ifdef USE_EVDEV
+#include <sys/socket.h>
+
+void setEvent(struct input_event *ev, int iType, int iCode, int iValue)
+{
+	memset(ev, 0, sizeof(struct input_event));
+	ev->type = iType;
+	ev->code = iCode;
+	ev->value = iValue;
+	return;
+}
+
+// A bindEvdev reading events from a pipe instead of a real device, and
+// passing unused events on to a socket instead of uinput (as though the
+// device had been grabbed), so no special permissions are needed.
+struct evdevReplay {
+	int fdIn[2];         // events to replay are written to fdIn[1]
+	int fdOut[2];        // events passed through are read from fdOut[1]
+	bindEvdev *dev;
+	boost::thread *thDev;
+
+	evdevReplay() :
+		dev(NULL),
+		thDev(NULL)
+	{
+	}
+
+	// Create the pipes and the device.  Returns false on failure.
+	bool open()
+	{
+		if ((pipe(this->fdIn) < 0) || (socketpair(AF_UNIX, SOCK_STREAM, 0, this->fdOut) < 0)) {
+			std::cerr << "Unable to create pipes: " << strerror(errno) << std::endl;
+			return false;
+		}
+		char cPath[64];
+		snprintf(cPath, sizeof(cPath), "/dev/fd/%d", this->fdIn[0]);
+		this->dev = new bindEvdev(0, cPath, false);
+		this->dev->uinputHandle = this->fdOut[0]; // pretend the device was grabbed
+		return true;
+	}
+
+	// Start the action thread and the device thread.
+	void start()
+	{
+		boost::thread thActions(boost::ref(::actions));
+		thActions.detach();
+		this->thDev = new boost::thread(boost::ref(*this->dev));
+		return;
+	}
+
+	// Write events to the device.  Returns false on failure.
+	bool send(const struct input_event *ev, int iCount)
+	{
+		if (write(this->fdIn[1], ev, sizeof(struct input_event) * iCount) < 0) {
+			std::cerr << "Write failed: " << strerror(errno) << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	// Read one passed through event.  Returns false on failure.
+	bool receive(struct input_event *ev)
+	{
+		if (read(this->fdOut[1], ev, sizeof(struct input_event)) != sizeof(struct input_event)) {
+			std::cerr << "Read failed: " << strerror(errno) << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	// Stop the device thread (end of file makes it exit, closing fdOut[0]
+	// as it does.)
+	void finish()
+	{
+		close(this->fdIn[1]);
+		this->thDev->join();
+		return;
+	}
+};
+#endif // USE_EVDEV
+
+#endif // REPLAY_H
@@ -0,0 +1,176 @@
+/*
+ * test_alloc.cpp - check that handling keypresses never allocates memory
+ *
+ * Copyright (C) 2009-2011 Adam Nielsen <a.nielsen@shikadi.net>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Replays a recording of evdev input through bindEvdev (event decoding,
+// hotkey matching, queueing actions and passing on unused events) and fails
+// if operator new is called at any point once everything has started up.
+
+#define XMMS2HOTKEY_NO_MAIN
+#include "xmms2hotkey.cpp"
+#include "replay.h"
+
+#include <new>
+
+#if __cplusplus >= 201103L
+#define NOTHROW noexcept
+#else
+#define NOTHROW throw()
+#endif
+
+#define NUM_REPLAYS 1000  // number of times to replay the recording
+
+// Used by every thread
+#if __cplusplus >= 201103L
+#include <atomic>
+std::atomic<bool> bCountAllocs(false);
+std::atomic<int> iNumAllocs(0);
+std::atomic<int> iNumActions(0);
+#else
+volatile bool bCountAllocs = false;
+volatile int iNumAllocs = 0;
+volatile int iNumActions = 0;
+#endif
+
+void *operator new(std::size_t iSize)
+{
+	if (bCountAllocs) iNumAllocs++;
+	void *p = std::malloc(iSize ? iSize : 1);
+	if (!p) throw std::bad_alloc();
+	return p;
+}
+
+void *operator new[](std::size_t iSize)
+{
+	return operator new(iSize);
+}
+
+void operator delete(void *p) NOTHROW
+{
+	std::free(p);
+}
+
+void operator delete[](void *p) NOTHROW
+{
+	std::free(p);
+}
+
+#ifdef USE_EVDEV
+#define WHEEL_UP (0x1000 + REL_WHEEL * 2)
+
+// Recorded input: type, code, value
+const int iRecording[][3] = {
+	// Plain typing, not hotkeys
+	{EV_MSC, MSC_SCAN, 0x70004}, {EV_KEY, KEY_A, 1}, {EV_SYN, SYN_REPORT, 0},
+	{EV_KEY, KEY_A, 2}, {EV_SYN, SYN_REPORT, 0},
+	{EV_MSC, MSC_SCAN, 0x70004}, {EV_KEY, KEY_A, 0}, {EV_SYN, SYN_REPORT, 0},
+	// F10 on its own
+	{EV_KEY, KEY_F10, 1}, {EV_SYN, SYN_REPORT, 0},
+	{EV_KEY, KEY_F10, 0}, {EV_SYN, SYN_REPORT, 0},
+	// F10+Down, with autorepeat on Down
+	{EV_KEY, KEY_F10, 1}, {EV_SYN, SYN_REPORT, 0},
+	{EV_KEY, KEY_DOWN, 1}, {EV_SYN, SYN_REPORT, 0},
+	{EV_KEY, KEY_DOWN, 2}, {EV_SYN, SYN_REPORT, 0},
+	{EV_KEY, KEY_DOWN, 0}, {EV_SYN, SYN_REPORT, 0},
+	{EV_KEY, KEY_F10, 0}, {EV_SYN, SYN_REPORT, 0},
+	// Down on its own isn't a hotkey
+	{EV_KEY, KEY_DOWN, 1}, {EV_SYN, SYN_REPORT, 0},
+	{EV_KEY, KEY_DOWN, 0}, {EV_SYN, SYN_REPORT, 0},
+	// Shift+P
+	{EV_KEY, KEY_LEFTSHIFT, 1}, {EV_SYN, SYN_REPORT, 0},
+	{EV_KEY, KEY_P, 1}, {EV_SYN, SYN_REPORT, 0},
+	{EV_KEY, KEY_P, 0}, {EV_SYN, SYN_REPORT, 0},
+	{EV_KEY, KEY_LEFTSHIFT, 0}, {EV_SYN, SYN_REPORT, 0},
+	// P without shift isn't a hotkey
+	{EV_KEY, KEY_P, 1}, {EV_SYN, SYN_REPORT, 0},
+	{EV_KEY, KEY_P, 0}, {EV_SYN, SYN_REPORT, 0},
+	// Mouse movement and scrolling
+	{EV_REL, REL_X, 3}, {EV_REL, REL_Y, -2}, {EV_SYN, SYN_REPORT, 0},
+	{EV_REL, REL_WHEEL_HI_RES, -120}, {EV_REL, REL_WHEEL, -1}, {EV_SYN, SYN_REPORT, 0},
+	{EV_REL, REL_WHEEL_HI_RES, 120}, {EV_REL, REL_WHEEL, 1}, {EV_SYN, SYN_REPORT, 0},
+};
+#define RECORDING_LEN (sizeof(iRecording) / sizeof(iRecording[0]))
+
+// Number of actions each pass through the recording should trigger
+#define ACTIONS_PER_REPLAY 6  // F10 twice, F10+Down twice (repeat), Shift+P, wheel up
+
+void countAction()
+{
+	iNumActions++;
+	return;
+}
+
+// Read and discard everything passed through
+void drain(int fd)
+{
+	char buf[4096];
+	while (read(fd, buf, sizeof(buf)) > 0);
+	return;
+}
+
+int main(void)
+{
+	// Set up the hotkeys, as loading the config file would
+	loadHotkey(HK_EVDEV, KEY_F10, -1, 0, 0, &countAction);
+	loadHotkey(HK_EVDEV, KEY_F10, -1, HK_EVDEV, KEY_DOWN, &countAction);
+	loadHotkey(HK_EVDEV, KEY_P, 1, 0, 0, &countAction);
+	loadHotkey(HK_EVDEV, WHEEL_UP, -1, 0, 0, &countAction);
+	vcActiveHotkeys.reserve(vcHotkeys.size());
+
+	evdevReplay replay;
+	if (!replay.open()) return EXIT_FAILURE;
+
+	std::cout << "Replaying " << NUM_REPLAYS << " times..." << std::endl;
+
+	// Everything from here on counts as the hot path
+	boost::thread thDrain(boost::bind(&drain, replay.fdOut[1]));
+	replay.start();
+	bCountAllocs = true;
+
+	int iExpected = 0;
+	for (int r = 0; r < NUM_REPLAYS; r++) {
+		for (unsigned int i = 0; i < RECORDING_LEN; i++) {
+			struct input_event ev;
+			setEvent(&ev, iRecording[i][0], iRecording[i][1], iRecording[i][2]);
+			if (!replay.send(&ev, 1)) return EXIT_FAILURE;
+		}
+		// Wait for the actions to run, so the queue never fills up
+		iExpected += ACTIONS_PER_REPLAY;
+		for (int iWait = 0; (iNumActions < iExpected) && (iWait < 5000); iWait++) {
+			usleep(1000);
+		}
+	}
+	replay.finish();
+	thDrain.join(); // the device thread closes the other end of this
+	bCountAllocs = false;
+
+	int iAllocs = iNumAllocs;
+	int iActions = iNumActions;
+	std::cout << iAllocs << " allocations, " << iActions << " of "
+		<< iExpected << " actions triggered" << std::endl;
+	if (iActions != iExpected) return EXIT_FAILURE;
+	return iAllocs ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#else
+int main(void)
+{
+	std::cerr << "evdev support not compiled in, skipping" << std::endl;
+	return 77;
+}
+#endif // USE_EVDEV
@@ -21,11 +21,16 @@
 
 #include <config.h>
 
+#include <xmmsclient/xmmsclient.h>
 #include <xmmsclient/xmmsclient++.h>
 #include <iostream>
 #include <cstdlib>
 #include <vector>
+#include <map>
+#include <algorithm>
+#include <set>
 #include <fstream>
+#include <ctime>
 #include <signal.h>
 
 #include <errno.h>
@@ -44,11 +49,388 @@ namespace po = boost::program_options;
 
 #ifdef USE_EVDEV
 #include <fcntl.h>
+#include <sys/ioctl.h>
+#include <poll.h>
 #include <linux/input.h>
+#include <linux/uinput.h>
 #endif // USE_EVDEV
 
 #define PROGNAME "[xmms2hotkey] "
 
+// Album and artist of a single medialib entry, as cached by playlistMirror.
+typedef struct {
+	std::string strAlbum;
+	std::string strArtist;
+} TRACK_INFO;
+
+typedef std::map<int, TRACK_INFO> MP_TRACKINFO;
+
+// Local copy of the active playlist, so that actions like "next album" can
+// work out where to go without fetching the whole playlist from the XMMS2
+// daemon on every keypress.  It uses its own connection to the daemon, which
+// only ever runs asynchronously (driven by the broadcasts for playlist
+// changes and the current position) in its own thread, reconnecting if the
+// daemon goes away.  The actions that use it (run in the action queue's
+// thread) only read from it, under the mutex.  It is only created if one of
+// those actions has been assigned to a hotkey.
+struct playlistMirror {
+	Xmms::Client *client;      // connection used only for the broadcasts
+	boost::mutex mtx;          // protects everything below
+	std::string strPlaylist;   // name of the active playlist
+	int iCurrentPos;           // current position, or -1 if none
+	std::vector<int> vcEntries; // medialib ID of each playlist entry
+	MP_TRACKINFO mpInfo;       // album/artist, by medialib ID
+	std::set<int> stWantInfo;  // IDs waiting to go in the next info query
+	bool bInfoQueryBusy;       // an info query for some IDs is in progress
+
+	playlistMirror(Xmms::Client *client) :
+		client(client),
+		iCurrentPos(-1),
+		bInfoQueryBusy(false)
+	{
+	}
+
+	// Thread entrypoint
+	void operator()()
+	{
+		this->client->setDisconnectCallback(
+			boost::bind(&playlistMirror::onDisconnect, this));
+
+		bool bReconnecting = false;
+		for (;;) {
+			if (!this->client->isConnected()) {
+				try {
+					this->client->connect(std::getenv("XMMS_PATH"));
+				} catch (Xmms::connection_error& e) {
+					if (!bReconnecting) {
+						std::cerr << PROGNAME "Could not connect to XMMS2 daemon for "
+							"the playlist mirror, will keep trying: " << e.what() << std::endl;
+						bReconnecting = true;
+					}
+					sleep(1);
+					continue;
+				}
+				if (bReconnecting) {
+					std::cerr << PROGNAME "Reconnected to XMMS2 daemon for the "
+						"playlist mirror" << std::endl;
+				}
+			}
+			bReconnecting = true; // any future connection is a reconnection
+
+			this->client->playlist.broadcastChanged()(
+				boost::bind(&playlistMirror::onChanged, this, _1));
+			this->client->playlist.broadcastCurrentPos()(
+				boost::bind(&playlistMirror::onCurrentPos, this, _1));
+			this->client->playlist.broadcastLoaded()(
+				boost::bind(&playlistMirror::onLoaded, this, _1));
+			this->client->medialib.broadcastEntryChanged()(
+				boost::bind(&playlistMirror::onEntryChanged, this, _1));
+
+			this->client->playlist.currentActive()(
+				boost::bind(&playlistMirror::onLoaded, this, _1));
+
+			// Only returns once the connection has been lost
+			this->client->getMainLoop().run();
+			sleep(1);
+		}
+		return;
+	}
+
+	// Return the current position, or -1 if there isn't one (yet).
+	int getCurrentPos()
+	{
+		boost::mutex::scoped_lock lock(this->mtx);
+		return this->iCurrentPos;
+	}
+
+	// Return the number of entries in the active playlist.
+	int getLength()
+	{
+		boost::mutex::scoped_lock lock(this->mtx);
+		return this->vcEntries.size();
+	}
+
+	// Find the position of the first track of the album iDelta albums away
+	// from the current one (1 = next album, -1 = previous album.)  Returns -1
+	// if there is no such album.
+	int findAlbum(int iDelta)
+	{
+		boost::mutex::scoped_lock lock(this->mtx);
+		int iLen = this->vcEntries.size();
+		int iPos = this->iCurrentPos;
+		if ((iPos < 0) || (iPos >= iLen)) return -1;
+
+		// Rewind to the first track of the current album
+		while ((iPos > 0) && this->sameAlbum(iPos - 1, iPos)) iPos--;
+
+		for (; iDelta > 0; iDelta--) {
+			int iNext = iPos + 1;
+			while ((iNext < iLen) && this->sameAlbum(iNext, iPos)) iNext++;
+			if (iNext >= iLen) return -1;
+			iPos = iNext;
+		}
+		for (; iDelta < 0; iDelta++) {
+			if (iPos == 0) return -1;
+			iPos--;
+			while ((iPos > 0) && this->sameAlbum(iPos - 1, iPos)) iPos--;
+		}
+		return iPos;
+	}
+
+	private:
+		// Do the entries at these two positions belong to the same album?
+		// Must be called with the mutex held.
+		bool sameAlbum(int iPosA, int iPosB)
+		{
+			MP_TRACKINFO::const_iterator a = this->mpInfo.find(this->vcEntries[iPosA]);
+			MP_TRACKINFO::const_iterator b = this->mpInfo.find(this->vcEntries[iPosB]);
+			// Entries we don't have info for yet, or which have no album tag, are
+			// treated as albums of their own
+			if ((a == this->mpInfo.end()) || (b == this->mpInfo.end())) return false;
+			if (a->second.strAlbum.empty()) return false;
+			// Different artists can have albums with the same name
+			return (a->second.strAlbum.compare(b->second.strAlbum) == 0) &&
+				(a->second.strArtist.compare(b->second.strArtist) == 0);
+		}
+
+		// Ask for the info of a medialib entry, if we don't have it already.
+		// Must be called with the mutex held.
+		void requestInfo(int iId)
+		{
+			if (this->mpInfo.find(iId) != this->mpInfo.end()) return;
+			this->stWantInfo.insert(iId);
+			this->sendInfoQuery();
+			return;
+		}
+
+		// Query the info for all the IDs waiting for it.  Only one query is sent
+		// at a time, so IDs added while it's in progress (e.g. when a whole
+		// directory is being added to the playlist) all go in the next one.
+		// Must be called with the mutex held.
+		void sendInfoQuery()
+		{
+			if (this->bInfoQueryBusy || this->stWantInfo.empty()) return;
+			Xmms::Coll::Idlist coll;
+			for (std::set<int>::iterator i = this->stWantInfo.begin(); i != this->stWantInfo.end(); i++) {
+				coll.append(*i);
+			}
+			this->stWantInfo.clear();
+			this->client->collection.queryInfos(coll, infoFields())(
+				boost::bind(&playlistMirror::onInfos, this, false, _1),
+				boost::bind(&playlistMirror::onInfosError, this, false, _1));
+			this->bInfoQueryBusy = true;
+			return;
+		}
+
+		// Fields to fetch for each entry
+		static std::list<std::string> infoFields()
+		{
+			std::list<std::string> lsFetch;
+			lsFetch.push_back("id");
+			lsFetch.push_back("album");
+			lsFetch.push_back("artist");
+			return lsFetch;
+		}
+
+		// Fetch the whole active playlist, and album/artist for every entry in
+		// it in a single query.
+		void reload()
+		{
+			Xmms::Coll::Reference coll(this->strPlaylist, Xmms::Collection::PLAYLISTS);
+			this->client->playlist.listEntries(this->strPlaylist)(
+				boost::bind(&playlistMirror::onEntries, this, this->strPlaylist, _1));
+			this->client->collection.queryInfos(coll, infoFields())(
+				boost::bind(&playlistMirror::onInfos, this, true, _1),
+				boost::bind(&playlistMirror::onInfosError, this, true, _1));
+			this->client->playlist.currentPos(this->strPlaylist)(
+				boost::bind(&playlistMirror::onCurrentPos, this, _1));
+			return;
+		}
+
+		// Must be called with the mutex held.
+		void storeInfo(int iId, const Xmms::Dict& info)
+		{
+			TRACK_INFO& ti = this->mpInfo[iId];
+			ti.strAlbum = info.contains("album") ? boost::get<std::string>(info["album"]) : "";
+			ti.strArtist = info.contains("artist") ? boost::get<std::string>(info["artist"]) : "";
+			return;
+		}
+
+		bool onLoaded(const std::string& strPlaylist)
+		{
+			{
+				boost::mutex::scoped_lock lock(this->mtx);
+				this->strPlaylist = strPlaylist;
+				this->iCurrentPos = -1;
+				this->vcEntries.clear();
+				// The reload fetches the info again for everything in the playlist
+				this->mpInfo.clear();
+				this->stWantInfo.clear();
+			}
+			this->reload();
+			return true;
+		}
+
+		bool onEntries(const std::string& strPlaylist, const Xmms::List<int>& list)
+		{
+			boost::mutex::scoped_lock lock(this->mtx);
+			// Ignore the reply if another playlist has been loaded since
+			if (strPlaylist.compare(this->strPlaylist) != 0) return true;
+			this->vcEntries.clear();
+			for (Xmms::List<int>::const_iterator i = list.begin(); i != list.end(); ++i) {
+				this->vcEntries.push_back(*i);
+			}
+			return true;
+		}
+
+		// bReload is true for the info of the whole playlist, false for the
+		// reply to sendInfoQuery().
+		bool onInfos(bool bReload, const Xmms::List<Xmms::Dict>& list)
+		{
+			boost::mutex::scoped_lock lock(this->mtx);
+			for (Xmms::List<Xmms::Dict>::const_iterator i = list.begin(); i != list.end(); ++i) {
+				this->storeInfo(boost::get<int>((*i)["id"]), *i);
+			}
+			if (bReload) {
+				std::cout << PROGNAME "Mirrored playlist \"" << this->strPlaylist
+					<< "\" (" << this->vcEntries.size() << " entries)" << std::endl;
+			} else {
+				this->bInfoQueryBusy = false;
+				this->sendInfoQuery(); // anything that turned up in the meantime
+			}
+			return true;
+		}
+
+		bool onInfosError(bool bReload, const std::string& strError)
+		{
+			boost::mutex::scoped_lock lock(this->mtx);
+			std::cerr << PROGNAME "Unable to get album/artist for the playlist mirror: "
+				<< strError << std::endl;
+			if (!bReload) {
+				// Those IDs are dropped, but don't hold up any that arrived since
+				this->bInfoQueryBusy = false;
+				this->sendInfoQuery();
+			}
+			return true;
+		}
+
+		void onDisconnect()
+		{
+			std::cerr << PROGNAME "Lost connection used for the playlist mirror, "
+				"reconnecting" << std::endl;
+			{
+				// Forget everything, rather than acting on a stale playlist
+				boost::mutex::scoped_lock lock(this->mtx);
+				this->iCurrentPos = -1;
+				this->vcEntries.clear();
+				this->mpInfo.clear();
+				this->stWantInfo.clear();
+				this->bInfoQueryBusy = false;
+			}
+			this->client->quitLoop();
+			return;
+		}
+
+		bool onEntryChanged(const int& iId)
+		{
+			boost::mutex::scoped_lock lock(this->mtx);
+			// Only refresh entries we're interested in
+			if (this->mpInfo.erase(iId)) this->requestInfo(iId);
+			return true;
+		}
+
+		bool onCurrentPos(const Xmms::Dict& pos)
+		{
+			boost::mutex::scoped_lock lock(this->mtx);
+			if (pos.contains("name") &&
+				(boost::get<std::string>(pos["name"]).compare(this->strPlaylist) != 0)
+			) {
+				return true;
+			}
+			this->iCurrentPos = boost::get<int>(pos["position"]);
+			return true;
+		}
+
+		bool onChanged(const Xmms::Dict& change)
+		{
+			boost::mutex::scoped_lock lock(this->mtx);
+			if (boost::get<std::string>(change["name"]).compare(this->strPlaylist) != 0) {
+				return true; // not the active playlist
+			}
+			int iLen = this->vcEntries.size();
+			int iPos = change.contains("position") ? boost::get<int>(change["position"]) : -1;
+			switch (boost::get<int>(change["type"])) {
+				case XMMS_PLAYLIST_CHANGED_ADD:
+				case XMMS_PLAYLIST_CHANGED_INSERT: {
+					if ((iPos < 0) || (iPos > iLen)) break; // out of sync
+					int iId = boost::get<int>(change["id"]);
+					this->vcEntries.insert(this->vcEntries.begin() + iPos, iId);
+					this->requestInfo(iId);
+					return true;
+				}
+				case XMMS_PLAYLIST_CHANGED_REMOVE: {
+					if ((iPos < 0) || (iPos >= iLen)) break;
+					int iId = this->vcEntries[iPos];
+					this->vcEntries.erase(this->vcEntries.begin() + iPos);
+					// Forget the info if that was the last copy of this entry
+					if (std::find(this->vcEntries.begin(), this->vcEntries.end(), iId) == this->vcEntries.end()) {
+						this->mpInfo.erase(iId);
+					}
+					return true;
+				}
+				case XMMS_PLAYLIST_CHANGED_MOVE: {
+					int iNewPos = boost::get<int>(change["newposition"]);
+					if ((iPos < 0) || (iPos >= iLen) || (iNewPos < 0) || (iNewPos >= iLen)) break;
+					int iId = this->vcEntries[iPos];
+					this->vcEntries.erase(this->vcEntries.begin() + iPos);
+					this->vcEntries.insert(this->vcEntries.begin() + iNewPos, iId);
+					return true;
+				}
+				case XMMS_PLAYLIST_CHANGED_CLEAR:
+					this->vcEntries.clear();
+					this->mpInfo.clear();
+					return true;
+			}
+			// Shuffle, sort, etc. (or we got out of sync somehow.)  Refetch the
+			// list of entries, but we will already have the info for most of them.
+			this->client->playlist.listEntries(this->strPlaylist)(
+				boost::bind(&playlistMirror::onEntriesRefreshed, this, this->strPlaylist, _1));
+			return true;
+		}
+
+		bool onEntriesRefreshed(const std::string& strPlaylist, const Xmms::List<int>& list)
+		{
+			this->onEntries(strPlaylist, list);
+			boost::mutex::scoped_lock lock(this->mtx);
+			for (std::vector<int>::iterator i = this->vcEntries.begin(); i != this->vcEntries.end(); i++) {
+				this->requestInfo(*i);
+			}
+
+			// Forget the info for anything no longer in the playlist
+			std::set<int> stEntries(this->vcEntries.begin(), this->vcEntries.end());
+			for (MP_TRACKINFO::iterator i = this->mpInfo.begin(); i != this->mpInfo.end(); ) {
+				if (stEntries.find(i->first) == stEntries.end()) this->mpInfo.erase(i++);
+				else i++;
+			}
+			return true;
+		}
+};
+
+typedef enum {
+	MACRO_PLAY, MACRO_PAUSE, MACRO_STOP, MACRO_NEXT, MACRO_PREV, MACRO_JUMP,
+	MACRO_SEEK, MACRO_SEEKTO, MACRO_VOLUME
+} MACRO_TYPE;
+
+// One step of a user-defined macro action, e.g. "volume 40"
+typedef struct {
+	std::string strCommand; // as written in the config file, for messages
+	int iType;              // MACRO_*
+	int iValue;             // parameter, if the command takes one
+} MACRO_STEP;
+
+typedef std::vector<MACRO_STEP> VC_MACRO;
+typedef std::map<std::string, VC_MACRO> MP_MACROS;
+
 // Helper functions for triggering actions that require multiple calls to
 // the XMMS2 daemon.  (Since each hotkey event will only call one function.)
 namespace Xmms2Hotkey {
@@ -84,6 +466,137 @@ namespace Xmms2Hotkey {
 		p->playback.tickle();
 		return;
 	}
+	void jumpTrack(const Xmms::Client *p, playlistMirror *m, int iPos)
+	{
+		int iLen = m->getLength();
+		// If the mirror is empty, let the daemon decide whether the track exists
+		if ((iLen > 0) && (iPos >= iLen)) {
+			std::cerr << PROGNAME "Playlist has no track " << iPos + 1 << std::endl;
+			return;
+		}
+		p->playlist.setNext(iPos);
+		p->playback.tickle();
+		return;
+	}
+	void skipAlbum(const Xmms::Client *p, playlistMirror *m, int iDelta)
+	{
+		int iPos = m->findAlbum(iDelta);
+		if (iPos < 0) {
+			std::cerr << PROGNAME "No " << (iDelta > 0 ? "next" : "previous")
+				<< " album in the playlist" << std::endl;
+			return;
+		}
+		p->playlist.setNext(iPos);
+		p->playback.tickle();
+		return;
+	}
+	void randomTrack(const Xmms::Client *p, playlistMirror *m)
+	{
+		int iLen = m->getLength();
+		int iCurrentPos = m->getCurrentPos();
+		if (iLen < 2) return;
+		int iPos;
+		if ((iCurrentPos < 0) || (iCurrentPos >= iLen)) {
+			iPos = std::rand() % iLen;
+		} else {
+			// Pick any track other than the current one
+			iPos = std::rand() % (iLen - 1);
+			if (iPos >= iCurrentPos) iPos++;
+		}
+		p->playlist.setNext(iPos);
+		p->playback.tickle();
+		return;
+	}
+	// Send every request in the macro without waiting, then collect all the
+	// replies, so the whole macro costs about one round trip to the daemon.
+	// vcChannels lists the mixer channels to set for "volume" steps.
+	void runMacro(const Xmms::Client *p, const VC_MACRO& vcMacro,
+		const std::vector<std::string>& vcChannels)
+	{
+		xmmsc_connection_t *conn = p->getConnection();
+		if ((!conn) || (!p->isConnected())) {
+			// Sending the requests would only produce an error from each one
+			for (unsigned int i = 0; i < vcMacro.size(); i++) {
+				std::cerr << PROGNAME "Macro step \"" << vcMacro[i].strCommand
+					<< "\" failed: not connected to XMMS2 daemon" << std::endl;
+			}
+			return;
+		}
+		std::vector<xmmsc_result_t *> vcResults;
+		std::vector<int> vcStep; // index into vcMacro for each result
+		for (unsigned int i = 0; i < vcMacro.size(); i++) {
+			const MACRO_STEP& step = vcMacro[i];
+			switch (step.iType) {
+				case MACRO_PLAY:
+					vcResults.push_back(xmmsc_playback_start(conn));
+					break;
+				case MACRO_PAUSE:
+					vcResults.push_back(xmmsc_playback_pause(conn));
+					break;
+				case MACRO_STOP:
+					vcResults.push_back(xmmsc_playback_stop(conn));
+					break;
+				case MACRO_NEXT:
+				case MACRO_PREV:
+					vcResults.push_back(xmmsc_playlist_set_next_rel(conn,
+						step.iType == MACRO_NEXT ? 1 : -1));
+					vcStep.push_back(i);
+					vcResults.push_back(xmmsc_playback_tickle(conn));
+					break;
+				case MACRO_JUMP:
+					vcResults.push_back(xmmsc_playlist_set_next(conn, step.iValue));
+					vcStep.push_back(i);
+					vcResults.push_back(xmmsc_playback_tickle(conn));
+					break;
+				case MACRO_SEEK:
+					vcResults.push_back(xmmsc_playback_seek_ms(conn, step.iValue,
+						XMMS_PLAYBACK_SEEK_CUR));
+					break;
+				case MACRO_SEEKTO:
+					vcResults.push_back(xmmsc_playback_seek_ms(conn, step.iValue,
+						XMMS_PLAYBACK_SEEK_SET));
+					break;
+				case MACRO_VOLUME:
+					if (vcChannels.empty()) {
+						std::cerr << PROGNAME "Macro step \"" << step.strCommand
+							<< "\" skipped: no mixer channels found" << std::endl;
+						continue;
+					}
+					for (unsigned int c = 0; c < vcChannels.size(); c++) {
+						vcResults.push_back(xmmsc_playback_volume_set(conn,
+							vcChannels[c].c_str(), step.iValue));
+						vcStep.push_back(i);
+					}
+					continue; // one step already recorded per channel
+			}
+			vcStep.push_back(i);
+		}
+
+		// All the requests are on their way, now wait for the replies
+		int iLastFailed = -1;
+		for (unsigned int r = 0; r < vcResults.size(); r++) {
+			const char *cError;
+			if (!vcResults[r]) {
+				// Request couldn't be sent (e.g. connection lost part way through)
+				if (vcStep[r] != iLastFailed) {
+					std::cerr << PROGNAME "Macro step \"" << vcMacro[vcStep[r]].strCommand
+						<< "\" failed: unable to send request" << std::endl;
+					iLastFailed = vcStep[r];
+				}
+				continue;
+			}
+			xmmsc_result_wait(vcResults[r]);
+			xmmsv_t *val = xmmsc_result_get_value(vcResults[r]);
+			if (xmmsv_get_error(val, &cError) && (vcStep[r] != iLastFailed)) {
+				// Only report the first failure of a multi-request step
+				std::cerr << PROGNAME "Macro step \"" << vcMacro[vcStep[r]].strCommand
+					<< "\" failed: " << cError << std::endl;
+				iLastFailed = vcStep[r];
+			}
+			xmmsc_result_unref(vcResults[r]);
+		}
+		return;
+	}
 }
 
 struct config {
@@ -109,13 +622,19 @@ struct hotkey {
 
 typedef struct hotkey HOTKEY;
 
+// Hotkeys currently held down.  These point into vcHotkeys, which doesn't
+// change once the config file has been loaded, and there is room reserved
+// for every hotkey at startup so that keypresses never need to allocate.
+typedef std::vector<HOTKEY *> VC_ACTIVEHOTKEYS;
+
 VC_HOTKEYS vcHotkeys;
-VC_HOTKEYS vcActiveHotkeys;
+VC_ACTIVEHOTKEYS vcActiveHotkeys;
 
 typedef struct {
 	int iIndex;
 	std::string strId;           // "evdev0" etc.
 	std::string strDevicePath;   // "/dev/input/event1" etc.
+	bool bGrab;                  // take exclusive control of the device
 } EVDEV_INFO;
 
 class EUndefinedKey: virtual public std::exception {
@@ -176,7 +695,97 @@ VC_HOTKEYS::iterator searchHotkeyVector(VC_HOTKEYS &vcHotkeys,
 	return vcHotkeys.end();
 }
 
-void processKeypress(int hkiType, int iKey, int iModifier)
+// Same as searchHotkeyVector(), but for the list of active hotkeys.
+VC_ACTIVEHOTKEYS::iterator searchActiveHotkeys(int hkiType, int iKey, int iModifier)
+{
+	for (VC_ACTIVEHOTKEYS::iterator i = vcActiveHotkeys.begin(); i != vcActiveHotkeys.end(); i++) {
+		if (((*i)->hkiType == hkiType) && ((*i)->iKey == iKey) &&
+			(
+				((*i)->iModifier == -1) ||
+				((*i)->iModifier == iModifier))
+		) {
+			return i;
+		}
+	}
+	return vcActiveHotkeys.end();
+}
+
+#define ACTION_QUEUE_SIZE 64  // maximum number of actions waiting to run
+
+// Actions waiting to be run.  They are run in their own thread, so that
+// waiting for the XMMS2 daemon never holds up reading input events (or
+// passing them on, for grabbed evdev devices.)  The queue is a fixed size, so
+// queueing an action never needs to allocate.
+struct actionQueue {
+	boost::mutex mtx;
+	boost::condition_variable cond;
+	const boost::function<void()> *fnQueue[ACTION_QUEUE_SIZE];
+	unsigned int iHead;   // index of the next action to run
+	unsigned int iCount;  // number of actions waiting
+
+	actionQueue() :
+		iHead(0),
+		iCount(0)
+	{
+	}
+
+	// Queue an action.  fnAction must stay valid until it has been run.
+	void push(const boost::function<void()> *fnAction)
+	{
+		{
+			boost::mutex::scoped_lock lock(this->mtx);
+			if (this->iCount == ACTION_QUEUE_SIZE) {
+				std::cerr << PROGNAME "Too many actions waiting to run, ignoring hotkey"
+					<< std::endl;
+				return;
+			}
+			this->fnQueue[(this->iHead + this->iCount) % ACTION_QUEUE_SIZE] = fnAction;
+			this->iCount++;
+		}
+		this->cond.notify_one();
+		return;
+	}
+
+	// Run all the actions currently waiting, without blocking if there are none.
+	void runPending()
+	{
+		for (;;) {
+			const boost::function<void()> *fnAction;
+			{
+				boost::mutex::scoped_lock lock(this->mtx);
+				if (this->iCount == 0) break;
+				fnAction = this->fnQueue[this->iHead];
+				this->iHead = (this->iHead + 1) % ACTION_QUEUE_SIZE;
+				this->iCount--;
+			}
+			try {
+				(*fnAction)();
+			} catch (Xmms::result_error& e) {
+				std::cerr << PROGNAME "Unable to trigger hotkey action: " << e.what() << std::endl;
+			}
+		}
+		return;
+	}
+
+	// Thread entrypoint
+	void operator()()
+	{
+		for (;;) {
+			{
+				boost::mutex::scoped_lock lock(this->mtx);
+				while (this->iCount == 0) this->cond.wait(lock);
+			}
+			this->runPending();
+		}
+	}
+};
+
+// Never freed, as its thread is still waiting on it when we exit
+actionQueue& actions = *new actionQueue();
+
+// Returns true if the keypress matched a hotkey or subkey, false if it's of
+// no interest to us.
+bool processKeypress(int hkiType, int iKey, int iModifier)
 {
 //	printf("key: %d, state: %d, devtype: %d\n", iKey, iModifier, hkiType);
 	VC_HOTKEYS::iterator itHK = searchHotkeyVector(vcHotkeys, hkiType,
@@ -185,11 +794,7 @@ void processKeypress(int hkiType, int iKey, int iModifier)
 		// This keypress matched a primary hotkey
 		if (itHK->fnAction) {
 			std::cout << PROGNAME "Matched " << iKey << ", triggering action" << std::endl;
-			try {
-				itHK->fnAction(); // trigger the action, if one has been specified
-			} catch (Xmms::result_error& e) {
-				std::cerr << PROGNAME "Unable to trigger hotkey action: " << e.what() << std::endl;
-			}
+			actions.push(&itHK->fnAction); // trigger the action, if one has been specified
 		}
 
 		// If this is the only primary hotkey pressed, we're done.  If another
@@ -198,24 +803,20 @@ void processKeypress(int hkiType, int iKey, int iModifier)
 		// confusing setups like play=f1+f2, stop=f2+f1.
 		if (vcActiveHotkeys.size() == 0) {
 			// Flag this hotkey as a currently active one (add to 'active' vector)
-			vcActiveHotkeys.push_back(*itHK);
-			return;
+			vcActiveHotkeys.push_back(&*itHK);
+			return true;
 		}
 	}
 
 	// If we're here, a subkey was pressed while one of the actual hotkeys is being held down
-	for (VC_HOTKEYS::iterator i = vcActiveHotkeys.begin(); i != vcActiveHotkeys.end(); i++) {
-		VC_HOTKEYS::iterator itHK = searchHotkeyVector(i->vcSubActions, hkiType, iKey, iModifier);
-		if (itHK != i->vcSubActions.end()) {
+	for (VC_ACTIVEHOTKEYS::iterator i = vcActiveHotkeys.begin(); i != vcActiveHotkeys.end(); i++) {
+		VC_HOTKEYS::iterator itHK = searchHotkeyVector((*i)->vcSubActions, hkiType, iKey, iModifier);
+		if (itHK != (*i)->vcSubActions.end()) {
 			if (itHK->fnAction) {
 				std::cout << PROGNAME "Matched subkey " << iKey << ", triggering action" << std::endl;
-				try {
-					itHK->fnAction(); // trigger the action, if one has been specified
-				} catch (Xmms::result_error& e) {
-					std::cerr << PROGNAME "Unable to trigger hotkey action: " << e.what() << std::endl;
-				}
+				actions.push(&itHK->fnAction); // trigger the action, if one has been specified
 			}
-			return; // matched, don't continue and add as a hotkey if it's a main key
+			return true; // matched, don't continue and add as a hotkey if it's a main key
 			//break; // won't check for additional matches
 		}
 	}
@@ -224,28 +825,29 @@ void processKeypress(int hkiType, int iKey, int iModifier)
 		// Now we've processed any subkeys *without* the primary hotkey being
 		// flagged active, time to flag it active for any subsequent keys.
 
-		VC_HOTKEYS::iterator itActHK = searchHotkeyVector(vcActiveHotkeys,
-			hkiType, iKey, iModifier);
+		VC_ACTIVEHOTKEYS::iterator itActHK = searchActiveHotkeys(hkiType, iKey,
+			iModifier);
 		// ...but only if it's not already in the list of activated hotkeys
-		if (itActHK == vcHotkeys.end()) {
+		if (itActHK == vcActiveHotkeys.end()) {
 			// Flag this hotkey as a currently active one (add to 'active' vector)
-			vcActiveHotkeys.push_back(*itHK);
+			vcActiveHotkeys.push_back(&*itHK);
 		}
+		return true;
 	}
-	/*for (VC_HOTKEYS::iterator i = vcActiveHotkeys.begin(); i != vcActiveHotkeys.end(); i++) {
-		std::cout << "active hotkeys: " << i->iKey << "\n";
+	/*for (VC_ACTIVEHOTKEYS::iterator i = vcActiveHotkeys.begin(); i != vcActiveHotkeys.end(); i++) {
+		std::cout << "active hotkeys: " << (*i)->iKey << "\n";
 	}*/
-	return;
+	return false;
 }
 
 void processKeyrelease(int hkiType, int iKey, int iModifier)
 {
-	VC_HOTKEYS::iterator itHK = searchHotkeyVector(vcActiveHotkeys, hkiType, iKey, iModifier);
+	VC_ACTIVEHOTKEYS::iterator itHK = searchActiveHotkeys(hkiType, iKey, iModifier);
 	if (itHK != vcActiveHotkeys.end()) {
 		vcActiveHotkeys.erase(itHK);
 	}
-	/*for (VC_HOTKEYS::iterator i = vcActiveHotkeys.begin(); i != vcActiveHotkeys.end(); i++) {
-		std::cout << "active hotkeys: " << i->iKey << "\n";
+	/*for (VC_ACTIVEHOTKEYS::iterator i = vcActiveHotkeys.begin(); i != vcActiveHotkeys.end(); i++) {
+		std::cout << "active hotkeys: " << (*i)->iKey << "\n";
 	}*/
 	return;
 }
@@ -312,28 +914,301 @@ struct bindX11 {
 #endif // USE_X11
 
 #ifdef USE_EVDEV
+// Which of the modifier keys are held down, one bit per key
+#define MOD_LEFTSHIFT  (1<<0)
+#define MOD_RIGHTSHIFT (1<<1)
+#define MOD_LEFTCTRL   (1<<2)
+#define MOD_RIGHTCTRL  (1<<3)
+#define MOD_LEFTALT    (1<<4)
+#define MOD_RIGHTALT   (1<<5)
+
+// Return the MOD_* bit for the given evdev keycode, or 0 if it's not a modifier
+int evdevModifierBit(int iCode)
+{
+	switch (iCode) {
+		case KEY_LEFTSHIFT:  return MOD_LEFTSHIFT;
+		case KEY_RIGHTSHIFT: return MOD_RIGHTSHIFT;
+		case KEY_LEFTCTRL:   return MOD_LEFTCTRL;
+		case KEY_RIGHTCTRL:  return MOD_RIGHTCTRL;
+		case KEY_LEFTALT:    return MOD_LEFTALT;
+		case KEY_RIGHTALT:   return MOD_RIGHTALT;
+	}
+	return 0;
+}
+
+// Convert the held MOD_* bits into the X11 modifier flags used by hotkeys
+int evdevModifierState(int iHeldMods)
+{
+	int iState = 0;
+	if (iHeldMods & (MOD_LEFTSHIFT | MOD_RIGHTSHIFT)) iState |= 1;
+	if (iHeldMods & (MOD_LEFTCTRL | MOD_RIGHTCTRL)) iState |= 1<<2;
+	if (iHeldMods & (MOD_LEFTALT | MOD_RIGHTALT)) iState |= 1<<3;
+	return iState;
+}
+
+#define TEST_BIT(a, b) ((a)[(b) / 8] & (1 << ((b) % 8)))
+
+// High-resolution scroll wheel events, sent alongside the normal ones since
+// Linux 5.0
+#ifndef REL_WHEEL_HI_RES
+#define REL_WHEEL_HI_RES  0x0b
+#define REL_HWHEEL_HI_RES 0x0c
+#endif
+
+#define NUM_EVENTS 64  // maximum number of events to retrieve in one call
+
 struct bindEvdev {
 	int devHandle;
 	int iDevice;
 	std::string strDevName;
+	bool bGrab;        // grab the device exclusively and pass unused events on
+	int uinputHandle;  // passthrough device when grabbed, otherwise -1
+	bool bSoftRepeat;  // passthrough device does its own key repeat
 
-	bindEvdev(int iDevice, std::string strDevName) :
+	bindEvdev(int iDevice, std::string strDevName, bool bGrab) :
 		iDevice(iDevice),
-		strDevName(strDevName)
+		strDevName(strDevName),
+		bGrab(bGrab),
+		uinputHandle(-1),
+		bSoftRepeat(false)
 	{
-		this->devHandle = open(strDevName.c_str(), O_RDONLY);
+		this->devHandle = this->openDevice();
 		if (this->devHandle < 0) throw EBindFailed(strDevName, strerror(errno));
 	}
 
+	// Open the device.  Grabbed devices are opened for writing too if possible,
+	// so the keyboard LEDs set through the passthrough device can be sent back
+	// to it.
+	int openDevice()
+	{
+		if (this->bGrab) {
+			int h = open(this->strDevName.c_str(), O_RDWR);
+			if (h >= 0) return h;
+		}
+		return open(this->strDevName.c_str(), O_RDONLY);
+	}
+
+	// Is any key held down on the device?
+	bool anyKeyDown()
+	{
+		unsigned char cKeys[KEY_MAX / 8 + 1];
+		memset(cKeys, 0, sizeof(cKeys));
+		if (ioctl(this->devHandle, EVIOCGKEY(sizeof(cKeys)), cKeys) < 0) return false;
+		for (unsigned int i = 0; i < sizeof(cKeys); i++) {
+			if (cKeys[i]) return true;
+		}
+		return false;
+	}
+
+	// Throw away any events waiting to be read from the device.
+	void discardPending()
+	{
+		struct input_event events[NUM_EVENTS];
+		int iFlags = fcntl(this->devHandle, F_GETFL);
+		fcntl(this->devHandle, F_SETFL, iFlags | O_NONBLOCK);
+		while (read(this->devHandle, events, sizeof(events)) > 0);
+		fcntl(this->devHandle, F_SETFL, iFlags);
+		return;
+	}
+
+	// Read the modifier keys currently held down on the device.
+	int getHeldModifiers()
+	{
+		unsigned char cKeys[KEY_MAX / 8 + 1];
+		memset(cKeys, 0, sizeof(cKeys));
+		if (ioctl(this->devHandle, EVIOCGKEY(sizeof(cKeys)), cKeys) < 0) return 0;
+		int iHeldMods = 0;
+		for (int i = 0; i <= KEY_MAX; i++) {
+			if (TEST_BIT(cKeys, i)) iHeldMods |= evdevModifierBit(i);
+		}
+		return iHeldMods;
+	}
+
+	// Take exclusive control of the device, and create a uinput device with the
+	// same capabilities to pass on the events we don't use.  Returns false (with
+	// the device left ungrabbed) on failure.
+	bool startGrab()
+	{
+		// Opened for reading too, to receive LED and repeat rate changes
+		this->uinputHandle = open("/dev/uinput", O_RDWR | O_NONBLOCK);
+		if (this->uinputHandle < 0) {
+			this->uinputHandle = open("/dev/input/uinput", O_RDWR | O_NONBLOCK);
+		}
+		if (this->uinputHandle < 0) {
+			std::cerr << PROGNAME "Unable to open uinput device: " << strerror(errno)
+				<< " - not grabbing " << this->strDevName << std::endl;
+			return false;
+		}
+
+		struct uinput_user_dev uidev;
+		memset(&uidev, 0, sizeof(uidev));
+		snprintf(uidev.name, UINPUT_MAX_NAME_SIZE, "xmms2hotkey passthrough (%s)",
+			this->strDevName.c_str());
+		ioctl(this->devHandle, EVIOCGID, &uidev.id);
+
+		// Copy across every event type and code the real device supports
+		unsigned char cTypes[EV_MAX / 8 + 1];
+		memset(cTypes, 0, sizeof(cTypes));
+		ioctl(this->devHandle, EVIOCGBIT(0, sizeof(cTypes)), cTypes);
+		for (int iType = 0; iType <= EV_MAX; iType++) {
+			if (!TEST_BIT(cTypes, iType)) continue;
+			int iSetBit, iMaxCode;
+			switch (iType) {
+				case EV_KEY: iSetBit = UI_SET_KEYBIT; iMaxCode = KEY_MAX; break;
+				case EV_REL: iSetBit = UI_SET_RELBIT; iMaxCode = REL_MAX; break;
+				case EV_ABS: iSetBit = UI_SET_ABSBIT; iMaxCode = ABS_MAX; break;
+				case EV_MSC: iSetBit = UI_SET_MSCBIT; iMaxCode = MSC_MAX; break;
+				case EV_LED: iSetBit = UI_SET_LEDBIT; iMaxCode = LED_MAX; break;
+				case EV_REP: // the kernel will do the key repeat for us
+				case EV_SYN: iSetBit = 0; iMaxCode = 0; break;
+				default: continue; // not passed through
+			}
+			ioctl(this->uinputHandle, UI_SET_EVBIT, iType);
+			if (!iSetBit) continue;
+			unsigned char cCodes[KEY_MAX / 8 + 1];
+			memset(cCodes, 0, sizeof(cCodes));
+			ioctl(this->devHandle, EVIOCGBIT(iType, sizeof(cCodes)), cCodes);
+			for (int iCode = 0; iCode <= iMaxCode; iCode++) {
+				if (!TEST_BIT(cCodes, iCode)) continue;
+				ioctl(this->uinputHandle, iSetBit, iCode);
+				if (iType == EV_ABS) {
+					struct input_absinfo abs;
+					if (ioctl(this->devHandle, EVIOCGABS(iCode), &abs) == 0) {
+						uidev.absmin[iCode] = abs.minimum;
+						uidev.absmax[iCode] = abs.maximum;
+						uidev.absfuzz[iCode] = abs.fuzz;
+						uidev.absflat[iCode] = abs.flat;
+					}
+				}
+			}
+		}
+
+		if (
+			(write(this->uinputHandle, &uidev, sizeof(uidev)) != sizeof(uidev)) ||
+			(ioctl(this->uinputHandle, UI_DEV_CREATE) < 0)
+		) {
+			std::cerr << PROGNAME "Unable to create uinput device: " << strerror(errno)
+				<< " - not grabbing " << this->strDevName << std::endl;
+			close(this->uinputHandle);
+			this->uinputHandle = -1;
+			return false;
+		}
+
+		// Any keys held when we grab would have their release hidden from
+		// everyone else, leaving them stuck down, so only grab once they're all
+		// released.  A key could still go down just before the grab, so check
+		// again afterwards and start over if one did.
+		bool bWarned = false;
+		for (;;) {
+			while (this->anyKeyDown()) {
+				if (!bWarned) {
+					std::cerr << PROGNAME "Waiting for all keys on " << this->strDevName
+						<< " to be released before grabbing it" << std::endl;
+					bWarned = true;
+				}
+				usleep(50000);
+			}
+
+			if (ioctl(this->devHandle, EVIOCGRAB, 1) < 0) {
+				std::cerr << PROGNAME "Unable to grab " << this->strDevName << ": "
+					<< strerror(errno) << std::endl;
+				this->stopGrab();
+				return false;
+			}
+
+			// Everything before the grab has already been seen by everyone
+			// else, so it mustn't be passed through again.
+			this->discardPending();
+			if (!this->anyKeyDown()) break;
+			ioctl(this->devHandle, EVIOCGRAB, 0);
+		}
+
+		if (TEST_BIT(cTypes, EV_REP)) {
+			// Autorepeat events from the real device won't be passed on, as the
+			// passthrough device generates its own.  Start it off with the same
+			// repeat rate.
+			this->bSoftRepeat = true;
+			unsigned int iRep[2];
+			if (ioctl(this->devHandle, EVIOCGREP, iRep) == 0) {
+				struct input_event ev[3];
+				memset(ev, 0, sizeof(ev));
+				ev[0].type = EV_REP;
+				ev[0].code = REP_DELAY;
+				ev[0].value = iRep[0];
+				ev[1].type = EV_REP;
+				ev[1].code = REP_PERIOD;
+				ev[1].value = iRep[1];
+				ev[2].type = EV_SYN;
+				ev[2].code = SYN_REPORT;
+				this->passthrough(ev, 3);
+			}
+		}
+		std::cout << PROGNAME "Grabbed " << this->strDevName
+			<< ", passing unused events through uinput" << std::endl;
+		return true;
+	}
+
+	// Remove the passthrough device (the grab goes when the device is closed.)
+	void stopGrab()
+	{
+		if (this->uinputHandle < 0) return;
+		ioctl(this->uinputHandle, UI_DEV_DESTROY);
+		close(this->uinputHandle);
+		this->uinputHandle = -1;
+		this->bSoftRepeat = false;
+		return;
+	}
+
+	// Send keyboard LED and repeat rate changes made to the passthrough device
+	// (by X11, the console, etc.) back to the real device.
+	void feedback()
+	{
+		struct input_event events[NUM_EVENTS];
+		ssize_t iNumBytes;
+		while ((iNumBytes = read(this->uinputHandle, events, sizeof(events))) > 0) {
+			for (size_t i = 0; i < iNumBytes / sizeof(struct input_event); i++) {
+				if ((events[i].type != EV_LED) && (events[i].type != EV_REP)) continue;
+				if (write(this->devHandle, &events[i], sizeof(struct input_event)) < 0) {
+					std::cerr << PROGNAME "Unable to pass LED/repeat change on to "
+						<< this->strDevName << ": " << strerror(errno) << std::endl;
+					return;
+				}
+			}
+		}
+		return;
+	}
+
+	// Pass events on to everyone else.  Does nothing if not grabbed.
+	void passthrough(struct input_event *events, size_t iCount)
+	{
+		if ((this->uinputHandle < 0) || (iCount == 0)) return;
+		ssize_t iLen = sizeof(struct input_event) * iCount;
+		if (write(this->uinputHandle, events, iLen) != iLen) {
+			std::cerr << PROGNAME "Error passing events through from "
+				<< this->strDevName << ": " << strerror(errno) << std::endl;
+		}
+		return;
+	}
+
 	void operator()()
 	{
-		#define NUM_EVENTS 64  // maximum number of events to retrieve in one call
 		struct input_event events[NUM_EVENTS];
-		int iState = 0;
+		// Events to pass through, plus room for held high-res wheel events
+		struct input_event passEvents[NUM_EVENTS + 2];
+		size_t iNumPass = 0;
+		// High-res wheel events (vertical, horizontal) are held until we know
+		// whether the normal wheel event in the same report was used.
+		struct input_event evHiRes[2];
+		bool bHiResHeld[2] = { false, false };
+		bool bWheelUsed[2] = { false, false };
+		bool bConsumed[KEY_MAX + 1]; // keypress was used, hide its repeats/release
+		memset(bConsumed, 0, sizeof(bConsumed));
+		if (this->bGrab) this->startGrab();
+		int iHeldMods = this->getHeldModifiers();
 		for (;;) {
 			if (this->devHandle == -1) {
 				// Device was closed/lost, but not yet reopened
-				this->devHandle = open(this->strDevName.c_str(), O_RDONLY);
+				this->devHandle = this->openDevice();
 				if (this->devHandle < 0) {
 					// Device doesn't exist yet
 					sleep(1);
@@ -341,12 +1216,38 @@ struct bindEvdev {
 				} else {
 					std::cerr << PROGNAME "Successfully reopened device "
 						<< this->strDevName << std::endl;
+					memset(bConsumed, 0, sizeof(bConsumed));
+					bHiResHeld[0] = bHiResHeld[1] = false;
+					bWheelUsed[0] = bWheelUsed[1] = false;
+					if (this->bGrab) this->startGrab();
+					iHeldMods = this->getHeldModifiers();
+				}
+			}
+
+			if (this->uinputHandle >= 0) {
+				// Wait for input events, and LED changes going the other way
+				struct pollfd pfd[2];
+				pfd[0].fd = this->devHandle;
+				pfd[0].events = POLLIN;
+				pfd[1].fd = this->uinputHandle;
+				pfd[1].events = POLLIN;
+				if (poll(pfd, 2, -1) < 0) {
+					// If we've been interrupted, exit the thread
+					if (errno == EINTR) break;
+					continue;
 				}
+				if (pfd[1].revents & POLLIN) this->feedback();
+				// Carry on to read() for errors too, so they get reported
+				if (pfd[0].revents == 0) continue;
 			}
 
 			size_t iNumBytes = read(this->devHandle, events, sizeof(struct input_event) * NUM_EVENTS);
 
-			if (iNumBytes == (size_t)-1) {
+			if (iNumBytes == 0) {
+				// End of file, only happens if we're reading from a recording
+				break;
+
+			} else if (iNumBytes == (size_t)-1) {
 				// If we've been interrupted, exit the thread
 				if (errno == EINTR) break;
 
@@ -355,6 +1256,7 @@ struct bindEvdev {
 					std::cerr << PROGNAME "Lost device " << this->strDevName << std::endl;
 					close(this->devHandle);
 					this->devHandle = -1;
+					this->stopGrab();
 					continue;
 				}
 
@@ -370,24 +1272,53 @@ struct bindEvdev {
 				continue;
 			}
 			for (size_t i = 0; i < iNumBytes / sizeof(struct input_event); i++) {
+				int iState = evdevModifierState(iHeldMods);
 
 				// Massive hack to make mousewheel events appear as keypresses
 				if (events[i].type == EV_REL) {
 
 					// Ignore normal mouse movements (for performance reasons)
-					if ((events[i].code == REL_X) || (events[i].code == REL_Y)) continue;
+					if ((events[i].code == REL_X) || (events[i].code == REL_Y)) {
+						passEvents[iNumPass++] = events[i];
+						continue;
+					}
+
+					int iAxis = -1; // which wheel, for matching up high-res events
+					if ((events[i].code == REL_WHEEL) || (events[i].code == REL_WHEEL_HI_RES)) iAxis = 0;
+					else if ((events[i].code == REL_HWHEEL) || (events[i].code == REL_HWHEEL_HI_RES)) iAxis = 1;
+
+					if ((events[i].code == REL_WHEEL_HI_RES) || (events[i].code == REL_HWHEEL_HI_RES)) {
+						// Drop it if it goes with a wheel event we've used, otherwise
+						// hold on to it until we know.
+						if (!bWheelUsed[iAxis]) {
+							if (bHiResHeld[iAxis]) passEvents[iNumPass++] = evHiRes[iAxis];
+							evHiRes[iAxis] = events[i];
+							bHiResHeld[iAxis] = true;
+						}
+						continue;
+					}
 
-					events[i].code *= 2;
-					events[i].code += 0x1000; // larger than KEY_MAX
-					if (events[i].value > 0) events[i].code++; // scrolling down
+					int iCode = events[i].code * 2 + 0x1000; // larger than KEY_MAX
+					if (events[i].value > 0) iCode++; // scrolling down
 
 					if (::config.bShowEvents) {
-						std::cout << PROGNAME "Key " << events[i].code << " pressed." << std::endl;
+						std::cout << PROGNAME "Key " << iCode << " pressed." << std::endl;
 					}
 
+					// Send anything pending first, so it isn't held up by the action
+					this->passthrough(passEvents, iNumPass);
+					iNumPass = 0;
+
 					// Can't hold these "buttons" down, so do a quick press then release
-					processKeypress(HK_EVDEV + this->iDevice, events[i].code, iState);
-					processKeyrelease(HK_EVDEV + this->iDevice, events[i].code, iState);
+					bool bUsed = processKeypress(HK_EVDEV + this->iDevice, iCode, iState);
+					processKeyrelease(HK_EVDEV + this->iDevice, iCode, iState);
+					if (iAxis >= 0) {
+						// The high-res event goes the same way as this one
+						if (bHiResHeld[iAxis] && !bUsed) passEvents[iNumPass++] = evHiRes[iAxis];
+						bHiResHeld[iAxis] = false;
+						bWheelUsed[iAxis] = bUsed;
+					}
+					if (!bUsed) passEvents[iNumPass++] = events[i];
 
 				} else if (events[i].type == EV_KEY) { // key event
 					if ((::config.bShowEvents) &&
@@ -396,36 +1327,60 @@ struct bindEvdev {
 						std::cout << PROGNAME "Key " << events[i].code << " pressed." << std::endl;
 					}
 
+					bool bPass = true;
 					switch (events[i].value) {
 						case 0: // key release
 							processKeyrelease(HK_EVDEV + this->iDevice, events[i].code, iState);
+							if (events[i].code <= KEY_MAX) {
+								bPass = !bConsumed[events[i].code];
+								bConsumed[events[i].code] = false;
+							}
+							break;
+						case 1: { // key press
+							this->passthrough(passEvents, iNumPass);
+							iNumPass = 0;
+							bool bUsed = processKeypress(HK_EVDEV + this->iDevice, events[i].code, iState);
+							if (events[i].code <= KEY_MAX) bConsumed[events[i].code] = bUsed;
+							bPass = !bUsed;
 							break;
-						case 1: // key press
+						}
 						case 2: // autorepeat
+							this->passthrough(passEvents, iNumPass);
+							iNumPass = 0;
 							processKeypress(HK_EVDEV + this->iDevice, events[i].code, iState);
+							// Follow whatever happened to the original keypress
+							if (events[i].code <= KEY_MAX) bPass = !bConsumed[events[i].code];
+							// ...unless the passthrough device is repeating it already
+							if (this->bSoftRepeat) bPass = false;
 							break;
 					}
+					if (bPass) passEvents[iNumPass++] = events[i];
+
 					// Because evdev doesn't handle the keyboard state, we need to do this ourselves
 					if (events[i].value < 2) { // only handle 0 (keyrelease) and 1 (keypress)
-						switch (events[i].code) {
-							case KEY_LEFTSHIFT:
-							case KEY_RIGHTSHIFT: // 1
-								iState = (iState &~ 1) | (events[i].value & 1);
-								break;
-							case KEY_LEFTCTRL:
-							case KEY_RIGHTCTRL:
-								iState = (iState &~ (1<<2)) | ((events[i].value & 1) << 2);
-								break;
-							case KEY_LEFTALT:
-							case KEY_RIGHTALT:
-								iState = (iState &~ (1<<3)) | ((events[i].value & 1) << 3);
-								break;
+						int iBit = evdevModifierBit(events[i].code);
+						if (events[i].value) iHeldMods |= iBit;
+						else iHeldMods &= ~iBit;
+					}
+				} else {
+					// EV_SYN, EV_MSC, EV_ABS, etc.
+					if (events[i].type == EV_SYN) {
+						// End of this report, so any high-res wheel events still held
+						// didn't have a normal wheel event to go with.
+						for (int iAxis = 0; iAxis < 2; iAxis++) {
+							if (bHiResHeld[iAxis]) passEvents[iNumPass++] = evHiRes[iAxis];
+							bHiResHeld[iAxis] = false;
+							bWheelUsed[iAxis] = false;
 						}
 					}
+					passEvents[iNumPass++] = events[i];
 				}
 //printf("type: %d, code: %d, value %d\n", events[i].type, events[i].code, events[i].value);
 			}
+			this->passthrough(passEvents, iNumPass);
+			iNumPass = 0;
 		}
+		this->stopGrab();
 		close(this->devHandle);
 		return;
 	}
@@ -503,6 +1458,134 @@ VC_HOTKEYS& findKeyDef(MP_KEYDEFS& mpKeyDefs, const std::string& strKey)
 	throw std::exception();
 }
 
+// Names of the built-in events, which macros can't use
+const char *cBuiltinEvents[] = {
+	"play", "playpause", "pause", "stop", "skipprev", "skipnext", "prevalbum",
+	"nextalbum", "random", "seekfwd", "seekback", "volup", "voldown", NULL
+};
+
+// Parse a macro definition like "stop; jump 1; volume 40; play" into
+// vcMacro.  Returns false (after printing the reason) if it isn't valid.
+bool parseMacro(const std::string& strName, const std::string& strDef,
+	VC_MACRO& vcMacro)
+{
+	bool bClash = (strName.length() > 4) && (strName.compare(0, 4, "jump") == 0) &&
+		(strName.find_first_not_of("0123456789", 4) == std::string::npos);
+	for (int i = 0; cBuiltinEvents[i]; i++) {
+		if (strName.compare(cBuiltinEvents[i]) == 0) bClash = true;
+	}
+	if (bClash) {
+		std::cerr << PROGNAME "Macro \"" << strName << "\" has the same name as "
+			"a built-in event, ignoring macro." << std::endl;
+		return false;
+	}
+
+	std::string::size_type iStart = 0;
+	while (iStart < strDef.length()) {
+		std::string::size_type iEnd = strDef.find_first_of(';', iStart);
+		if (iEnd == std::string::npos) iEnd = strDef.length();
+
+		// Trim the whitespace from around this step
+		std::string::size_type iFirst = strDef.find_first_not_of(" \t", iStart);
+		std::string::size_type iLast = strDef.find_last_not_of(" \t", iEnd - 1);
+		if ((iFirst == std::string::npos) || (iFirst >= iEnd) || (iLast < iFirst)) {
+			iStart = iEnd + 1; // empty step, e.g. trailing semicolon
+			continue;
+		}
+
+		MACRO_STEP step;
+		step.strCommand = strDef.substr(iFirst, iLast - iFirst + 1);
+		step.iValue = 0;
+		std::string::size_type iSpace = step.strCommand.find_first_of(" \t");
+		std::string strCmd = step.strCommand.substr(0, iSpace);
+		std::string strArg;
+		if (iSpace != std::string::npos) {
+			strArg = step.strCommand.substr(step.strCommand.find_first_not_of(" \t", iSpace));
+		}
+		bool bNeedArg = true;
+
+		if (strCmd.compare("play") == 0) {
+			step.iType = MACRO_PLAY;
+			bNeedArg = false;
+		} else if (strCmd.compare("pause") == 0) {
+			step.iType = MACRO_PAUSE;
+			bNeedArg = false;
+		} else if (strCmd.compare("stop") == 0) {
+			step.iType = MACRO_STOP;
+			bNeedArg = false;
+		} else if (strCmd.compare("next") == 0) {
+			step.iType = MACRO_NEXT;
+			bNeedArg = false;
+		} else if (strCmd.compare("prev") == 0) {
+			step.iType = MACRO_PREV;
+			bNeedArg = false;
+		} else if (strCmd.compare("jump") == 0) {
+			step.iType = MACRO_JUMP;
+		} else if (strCmd.compare("seek") == 0) {
+			// "seek +5000" and "seek -5000" are relative, "seek 5000" is absolute
+			if ((!strArg.empty()) && ((strArg[0] == '+') || (strArg[0] == '-'))) {
+				step.iType = MACRO_SEEK;
+			} else {
+				step.iType = MACRO_SEEKTO;
+			}
+		} else if (strCmd.compare("volume") == 0) {
+			step.iType = MACRO_VOLUME;
+		} else {
+			std::cerr << PROGNAME "Unknown command \"" << strCmd << "\" in macro \""
+				<< strName << "\", ignoring macro." << std::endl;
+			return false;
+		}
+
+		if (bNeedArg) {
+			char *cEnd;
+			step.iValue = strtol(strArg.c_str(), &cEnd, 10);
+			if (strArg.empty() || (*cEnd != '\0')) {
+				std::cerr << PROGNAME "Command \"" << strCmd << "\" in macro \""
+					<< strName << "\" needs a number, ignoring macro." << std::endl;
+				return false;
+			}
+			if (step.iType == MACRO_JUMP) {
+				if (step.iValue < 1) {
+					std::cerr << PROGNAME "Invalid track number in macro \""
+						<< strName << "\", ignoring macro." << std::endl;
+					return false;
+				}
+				step.iValue--; // playlist positions start at zero
+			}
+		} else if (!strArg.empty()) {
+			std::cerr << PROGNAME "Command \"" << strCmd << "\" in macro \""
+				<< strName << "\" doesn't take a parameter, ignoring macro." << std::endl;
+			return false;
+		}
+		vcMacro.push_back(step);
+		iStart = iEnd + 1;
+	}
+	if (vcMacro.empty()) {
+		std::cerr << PROGNAME "Macro \"" << strName << "\" is empty, ignoring macro."
+			<< std::endl;
+		return false;
+	}
+	return true;
+}
+
+// Callback used to collect the names of the mixer channels
+void addChannel(std::vector<std::string> *vcChannels, const std::string& k,
+	const Xmms::Dict::Variant&)
+{
+	vcChannels->push_back(k);
+	return;
+}
+
+// Return the playlist mirror, creating it the first time an action needs it.
+// It gets its own connection to the daemon, which connects (and reconnects)
+// in the mirror's thread.  Neither are ever freed, as the thread may still be
+// using them when we exit.
+playlistMirror *needMirror(playlistMirror *&mirror)
+{
+	if (!mirror) mirror = new playlistMirror(new Xmms::Client("xmms2hotkey-mirror"));
+	return mirror;
+}
+
 void xmmsdc(Xmms::Client *client)
 {
 	if (!client->isConnected()) {
@@ -515,6 +1598,7 @@ void xmmsdc(Xmms::Client *client)
 	return;
 }
 
+#ifndef XMMS2HOTKEY_NO_MAIN
 int main(void)//int iArgC, char *cArgV[])
 {
 	// Defaults, overridden later by config file values (if any)
@@ -531,12 +1615,19 @@ int main(void)//int iArgC, char *cArgV[])
 		return EXIT_FAILURE;
 	}
 	client.setDisconnectCallback(boost::bind(xmmsdc, &client));
+	std::srand(std::time(NULL));
+
+	// Local copy of the playlist, only created if an action needs it
+	playlistMirror *mirror = NULL;
 
 	std::string strConfigFilename = Xmms::getUserConfDir() + "/clients/xmms2hotkey.conf";
 	std::cout << PROGNAME "Loading config from " << strConfigFilename << std::endl;
 
 	std::vector<std::string> vcXDisplays;
 	std::vector<EVDEV_INFO> vcEvDev;
+	std::vector<std::string> vcGrab;
+	MP_MACROS mpMacros;
+	std::vector<std::string> vcChannels; // mixer channels, for macros
 
 	MP_KEYDEFS mpKeyDefs;
 
@@ -556,8 +1647,19 @@ int main(void)//int iArgC, char *cArgV[])
 				evi.iIndex = vcEvDev.size();
 				evi.strId = i->string_key.substr(7);
 				evi.strDevicePath = i->value[0];
+				evi.bGrab = false;
 				vcEvDev.push_back(evi);
 
+			} else if (i->string_key.compare("listen.grab") == 0) {
+				vcGrab.push_back(i->value[0]);
+
+			} else if (i->string_key.compare(0, 7, "macros.") == 0) {
+				std::string strName = i->string_key.substr(7);
+				VC_MACRO vcMacro;
+				if (parseMacro(strName, i->value[0], vcMacro)) {
+					mpMacros[strName] = vcMacro;
+				}
+
 			} else if (i->string_key.compare("main.seek_step") == 0) {
 				::config.iSeekDelta = strtoul(i->value[0].c_str(), NULL, 10);
 
@@ -569,6 +1671,37 @@ int main(void)//int iArgC, char *cArgV[])
 			}
 		}
 
+		// Macros can't ask for the mixer channels without waiting for the
+		// reply, so find out what they are now.
+		for (MP_MACROS::iterator i = mpMacros.begin(); i != mpMacros.end(); i++) {
+			bool bVolume = false;
+			for (VC_MACRO::iterator j = i->second.begin(); j != i->second.end(); j++) {
+				if (j->iType == MACRO_VOLUME) bVolume = true;
+			}
+			if (!bVolume) continue;
+			try {
+				Xmms::Dict vol = client.playback.volumeGet();
+				vol.each(boost::bind(&addChannel, &vcChannels, _1, _2));
+			} catch (Xmms::result_error& e) {
+				std::cerr << PROGNAME "Unable to get mixer channels for macros: "
+					<< e.what() << std::endl;
+			}
+			break;
+		}
+
+		// Flag the devices to be grabbed, now they've all been listed
+		for (std::vector<std::string>::iterator i = vcGrab.begin(); i != vcGrab.end(); i++) {
+			std::vector<EVDEV_INFO>::iterator itDev;
+			for (itDev = vcEvDev.begin(); itDev != vcEvDev.end(); itDev++) {
+				if (itDev->strId.compare(*i) == 0) break;
+			}
+			if (itDev == vcEvDev.end()) {
+				std::cerr << PROGNAME "Can't grab unknown device \"" << *i << "\", ignoring." << std::endl;
+				continue;
+			}
+			itDev->bGrab = true;
+		}
+
 		// Then process the key definitions
 		for (std::vector<po::option>::iterator i = pa.options.begin(); i != pa.options.end(); i++) {
 			if (i->string_key.compare(0, 4, "key.") == 0) {
@@ -617,7 +1750,10 @@ int main(void)//int iArgC, char *cArgV[])
 			if (i->string_key.compare(0, 7, "events.") == 0) {
 				std::string strEvent = i->string_key.substr(7);
 				boost::function<void()> fnAction;
-				if (strEvent.compare("stop") == 0)
+				if (mpMacros.find(strEvent) != mpMacros.end())
+					fnAction = boost::bind(&Xmms2Hotkey::runMacro, &client,
+						mpMacros[strEvent], boost::cref(vcChannels));
+				else if (strEvent.compare("stop") == 0)
 					fnAction = boost::bind(&Xmms::Playback::stop, &client.playback);
 				else if (strEvent.compare("play") == 0)
 					fnAction = boost::bind(&Xmms::Playback::start, &client.playback);
@@ -634,6 +1770,22 @@ int main(void)//int iArgC, char *cArgV[])
 				else if (strEvent.compare("skipprev") == 0)
 					fnAction = boost::bind(&Xmms2Hotkey::skipTrack, &client, -1);
 
+				else if (strEvent.compare("nextalbum") == 0)
+					fnAction = boost::bind(&Xmms2Hotkey::skipAlbum, &client, needMirror(mirror), 1);
+				else if (strEvent.compare("prevalbum") == 0)
+					fnAction = boost::bind(&Xmms2Hotkey::skipAlbum, &client, needMirror(mirror), -1);
+				else if (strEvent.compare("random") == 0)
+					fnAction = boost::bind(&Xmms2Hotkey::randomTrack, &client, needMirror(mirror));
+				else if ((strEvent.compare(0, 4, "jump") == 0) && (strEvent.length() > 4)) {
+					// jumpN, where N is the track number, starting at 1
+					int iTrack = strtoul(strEvent.substr(4).c_str(), NULL, 10);
+					if (iTrack < 1) {
+						std::cerr << PROGNAME "Invalid track number in \"" << strEvent << "\", ignoring." << std::endl;
+						continue;
+					}
+					fnAction = boost::bind(&Xmms2Hotkey::jumpTrack, &client, needMirror(mirror), iTrack - 1);
+				}
+
 				else if (strEvent.compare("playpause") == 0)
 					fnAction = boost::bind(&Xmms2Hotkey::playpause, &client.playback);
 				else if (strEvent.compare("volup") == 0)
@@ -700,13 +1852,30 @@ int main(void)//int iArgC, char *cArgV[])
 		}
 	}*/
 
+	// Each hotkey can only be active once, so this is as big as the list of
+	// active hotkeys can get.
+	vcActiveHotkeys.reserve(vcHotkeys.size());
+
 	// Run each bind function (X11 display and evdev device) in a separate thread
 	boost::thread_group threads;
 
+	// Actions are run in their own thread, which like the mirror below never
+	// finishes.
+	boost::thread thActions(boost::ref(::actions));
+	thActions.detach();
+
+	// The playlist mirror gets its own thread too, but it isn't part of the
+	// group as it never finishes, and we want to exit once all the bind
+	// threads have.
+	if (mirror) {
+		boost::thread thMirror(boost::ref(*mirror));
+		thMirror.detach();
+	}
+
 #ifdef USE_EVDEV
 	for (std::vector<EVDEV_INFO>::iterator i = vcEvDev.begin(); i != vcEvDev.end(); i++) {
 		try {
-			bindEvdev o(i->iIndex, i->strDevicePath);
+			bindEvdev o(i->iIndex, i->strDevicePath, i->bGrab);
 			threads.create_thread(o);
 		} catch (std::exception& e) {
 			std::cerr << e.what() << std::endl;
@@ -739,3 +1908,4 @@ int main(void)//int iArgC, char *cArgV[])
 	std::cout << PROGNAME "Exiting." << std::endl;
 	return 0;
 }
+#endif // XMMS2HOTKEY_NO_MAIN